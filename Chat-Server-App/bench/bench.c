@@ -0,0 +1,308 @@
+/* Transport benchmark.
+ *
+ * Runs the server in-process (accept loop + client_receive threads) and
+ * measures, for each transport (loopback TCP, the Unix-domain socket, TLS):
+ *   - connection setup rate: connect (+ TLS handshake) until the MOTD
+ *     prompt arrives; TLS is measured with full and resumed handshakes
+ *   - broadcast fan-out: one sender chats into the Lobby, RECEIVERS
+ *     clients read; reports messages and bytes delivered per second, and
+ *     for TLS how many server sessions send through kTLS rather than
+ *     SSL_write()
+ *
+ * usage: bench [cert.pem key.pem]   (make bench creates the pair) */
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define CONNECTS 300
+#define RECEIVERS 32
+#define MESSAGES 2000
+#define MSG_LEN 256
+
+typedef enum { TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_TLS } Transport;
+
+static const char *transportName[] = { "tcp", "unix", "tls" };
+
+typedef struct Conn {
+    int fd;
+    SSL *ssl;
+} Conn;
+
+static int listeners[2] = { -1, -1 };  // loopback TCP, Unix
+static struct sockaddr_in listen_addr;
+static struct sockaddr_un unix_addr;
+static char unix_dir[] = "/tmp/chatbench.XXXXXX";
+static SSL_CTX *client_ctx;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* accept loop feeding the real client_receive(); fds live in a ring so the
+ * pointer handed to each thread stays valid */
+static void *acceptLoop(void *arg) {
+    static int fds[4096];
+    unsigned int n = 0;
+    (void)arg;
+    while (1) {
+        int c = accept_any_client(listeners, 2);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return NULL;
+        }
+        int *slot = &fds[n++ % (sizeof(fds) / sizeof(fds[0]))];
+        *slot = c;
+        pthread_t t;
+        if (pthread_create(&t, NULL, client_receive, slot) == 0) pthread_detach(t);
+        else close(c);
+    }
+}
+
+static int countUsers(void) {
+    int n = 0;
+    reader_lock();
+    for (UserNode *u = user_head; u; u = u->next) n++;
+    reader_unlock();
+    return n;
+}
+
+static void waitUsers(int want) {
+    while (countUsers() != want) usleep(1000);
+}
+
+static int connOpen(Conn *c, Transport t, SSL_SESSION *resume) {
+    int one = 1;
+    int rc;
+    c->ssl = NULL;
+    if (t == TRANSPORT_UNIX) {
+        c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (c->fd < 0) return -1;
+        rc = connect(c->fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr));
+    } else {
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0) return -1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        rc = connect(c->fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
+    }
+    if (rc < 0) {
+        close(c->fd);
+        return -1;
+    }
+    if (t == TRANSPORT_TLS) {
+        c->ssl = SSL_new(client_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        if (resume) SSL_set_session(c->ssl, resume);
+        if (SSL_connect(c->ssl) <= 0) {
+            ERR_print_errors_fp(stderr);
+            SSL_free(c->ssl);
+            close(c->fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t connRead(Conn *c, char *buf, size_t len) {
+    if (c->ssl) return SSL_read(c->ssl, buf, (int)len);
+    return read(c->fd, buf, len);
+}
+
+static ssize_t connWrite(Conn *c, const char *buf, size_t len) {
+    if (c->ssl) return SSL_write(c->ssl, buf, (int)len);
+    return write(c->fd, buf, len);
+}
+
+static void connClose(Conn *c) {
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+    close(c->fd);
+}
+
+/* read until the MOTD prompt */
+static int readPrompt(Conn *c) {
+    char buf[512];
+    size_t have = 0;
+    while (1) {
+        ssize_t n = connRead(c, buf + have, sizeof(buf) - 1 - have);
+        if (n <= 0) return -1;
+        have += (size_t)n;
+        buf[have] = '\0';
+        if (strstr(buf, "chat>")) return 0;
+        if (have >= sizeof(buf) - 1) have = 0;
+    }
+}
+
+static void benchConnects(Transport t, int resumed) {
+    SSL_SESSION *session = NULL;
+    Conn c;
+
+    if (resumed) {
+        /* prime a session; TLS 1.3 tickets arrive after the handshake */
+        if (connOpen(&c, t, NULL) < 0 || readPrompt(&c) < 0) return;
+        session = SSL_get1_session(c.ssl);
+        connClose(&c);
+    }
+    waitUsers(0);
+
+    int reused = 0;
+    double start = now();
+    for (int i = 0; i < CONNECTS; ++i) {
+        if (connOpen(&c, t, session) < 0 || readPrompt(&c) < 0) {
+            fprintf(stderr, "connect %d failed\n", i);
+            return;
+        }
+        if (c.ssl && SSL_session_reused(c.ssl)) reused++;
+        if (session) {
+            /* TLS 1.3 tickets are single use: keep the newest one */
+            SSL_SESSION_free(session);
+            session = SSL_get1_session(c.ssl);
+        }
+        connClose(&c);
+    }
+    double secs = now() - start;
+    waitUsers(0);
+
+    printf("%-4s connect%-9s %8.0f conn/s", transportName[t],
+           t == TRANSPORT_TLS ? (resumed ? " (resumed)" : " (full)") : "", CONNECTS / secs);
+    if (t == TRANSPORT_TLS) printf("   %d/%d reused", reused, CONNECTS);
+    printf("\n");
+    if (session) SSL_SESSION_free(session);
+}
+
+typedef struct Receiver {
+    Conn conn;
+    long bytes;
+    double done;
+} Receiver;
+
+/* each broadcast is "\n::name> text\nchat>": two newlines per message */
+static void *receive(void *arg) {
+    Receiver *r = arg;
+    char buf[16384];
+    long newlines = 0;
+    while (newlines < 2L * MESSAGES) {
+        ssize_t n = connRead(&r->conn, buf, sizeof(buf));
+        if (n <= 0) break;
+        r->bytes += n;
+        for (ssize_t i = 0; i < n; ++i) newlines += buf[i] == '\n';
+    }
+    r->done = now();
+    return NULL;
+}
+
+static void benchFanout(Transport t) {
+    Receiver rx[RECEIVERS];
+    pthread_t threads[RECEIVERS];
+    Conn sender;
+    char line[MSG_LEN + 1];
+
+    waitUsers(0);
+    for (int i = 0; i < RECEIVERS; ++i) {
+        memset(&rx[i], 0, sizeof(rx[i]));
+        if (connOpen(&rx[i].conn, t, NULL) < 0 || readPrompt(&rx[i].conn) < 0) {
+            fprintf(stderr, "receiver %d failed\n", i);
+            return;
+        }
+    }
+    if (connOpen(&sender, t, NULL) < 0 || readPrompt(&sender) < 0) return;
+    waitUsers(RECEIVERS + 1);
+    /* every server session exists once its user does */
+    int ktls, sessions = tls_session_count(&ktls);
+
+    memset(line, 'x', MSG_LEN - 1);
+    line[MSG_LEN - 1] = '\n';
+    double start = now();
+    for (int i = 0; i < RECEIVERS; ++i) pthread_create(&threads[i], NULL, receive, &rx[i]);
+    int sent = 0;
+    while (sent < MESSAGES && connWrite(&sender, line, MSG_LEN) == MSG_LEN) sent++;
+    if (sent < MESSAGES) {
+        /* receivers wait for every message; cut them off instead */
+        fprintf(stderr, "sender failed after %d messages\n", sent);
+        for (int i = 0; i < RECEIVERS; ++i) shutdown(rx[i].conn.fd, SHUT_RDWR);
+    }
+
+    long bytes = 0;
+    double end = start;
+    for (int i = 0; i < RECEIVERS; ++i) {
+        pthread_join(threads[i], NULL);
+        bytes += rx[i].bytes;
+        if (rx[i].done > end) end = rx[i].done;
+    }
+    double secs = end - start;
+    printf("%-4s fan-out  %d -> %d    %8.0f msg/s delivered  %7.1f MB/s", transportName[t],
+           sent, RECEIVERS, (double)sent * RECEIVERS / secs, bytes / secs / 1e6);
+    if (t == TRANSPORT_TLS) printf("   kTLS send %d/%d sessions", ktls, sessions);
+    printf("\n");
+
+    connClose(&sender);
+    for (int i = 0; i < RECEIVERS; ++i) connClose(&rx[i].conn);
+    waitUsers(0);
+}
+
+int main(int argc, char **argv) {
+    const char *cert = argc > 2 ? argv[1] : "cert.pem";
+    const char *key = argc > 2 ? argv[2] : "key.pem";
+    socklen_t alen = sizeof(listen_addr);
+    pthread_t acceptor;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listeners[0] = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_addr.sin_port = 0; /* ephemeral, so a running server is not disturbed */
+    if (listeners[0] < 0 || bind(listeners[0], (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0 ||
+        start_server(listeners[0], 128) < 0 ||
+        getsockname(listeners[0], (struct sockaddr *)&listen_addr, &alen) < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    /* private directory for the Unix socket, for the same reason */
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    if (!mkdtemp(unix_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(unix_addr.sun_path, sizeof(unix_addr.sun_path), "%s/%s", unix_dir, UNIX_SOCKET_NAME);
+    if ((listeners[1] = get_unix_server_socket(unix_addr.sun_path)) < 0 ||
+        start_server(listeners[1], 128) < 0) {
+        perror("listen");
+        return 1;
+    }
+    pthread_create(&acceptor, NULL, acceptLoop, NULL);
+
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT);
+
+    /* plaintext first, then the same server with TLS switched on */
+    benchConnects(TRANSPORT_TCP, 0);
+    benchConnects(TRANSPORT_UNIX, 0);
+    benchFanout(TRANSPORT_TCP);
+    benchFanout(TRANSPORT_UNIX);
+    unlink(unix_addr.sun_path);
+    rmdir(unix_dir);
+
+    if (tls_init(cert, key) < 0) {
+        fprintf(stderr, "tls_init(%s, %s) failed; run 'make certs'\n", cert, key);
+        return 1;
+    }
+    benchConnects(TRANSPORT_TLS, 0);
+    benchConnects(TRANSPORT_TLS, 1);
+    benchFanout(TRANSPORT_TLS);
+    tls_shutdown();
+
+    SSL_CTX_free(client_ctx);
+    return 0;
+}
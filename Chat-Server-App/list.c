@@ -12,6 +12,7 @@ UserNode* insertFirstUser(UserNode *head, int socket, const char *username) {
     strncpy(newUser->username, username, MAX_NAME_LEN);
     newUser->rooms = NULL;
     newUser->directConns = NULL;
+    newUser->hashNext = NULL;
     newUser->next = head;
     return newUser;
 }
@@ -39,13 +40,7 @@ void removeUserU(UserNode **head, int socket) {
     while(cur) {
         if(cur->socket == socket) {
             removeAllRoomsFromUserU(cur);
-            // free direct connections
-            DirectConnNode *dc = cur->directConns;
-            while(dc) {
-                DirectConnNode *tmp = dc;
-                dc = dc->next;
-                free(tmp);
-            }
+            removeAllDirectConnsU(cur); // also unlinks us from each peer
             if(prev) prev->next = cur->next;
             else *head = cur->next;
             free(cur);
@@ -109,22 +104,22 @@ void removeAllRoomsFromUserU(UserNode *user) {
     user->rooms = NULL;
 }
 
-void addDirectConnU(UserNode *user, const char *toUser) {
+static void linkDirectConn(UserNode *user, UserNode *peer) {
     DirectConnNode *cur = user->directConns;
     while(cur) {
-        if(strcmp(cur->username, toUser) == 0) return; // already connected
+        if(cur->peer == peer) return; // already connected
         cur = cur->next;
     }
     DirectConnNode *newNode = (DirectConnNode *)malloc(sizeof(DirectConnNode));
-    strncpy(newNode->username, toUser, MAX_NAME_LEN);
+    newNode->peer = peer;
     newNode->next = user->directConns;
     user->directConns = newNode;
 }
 
-void removeDirectConnU(UserNode *user, const char *toUser) {
+static void unlinkDirectConn(UserNode *user, UserNode *peer) {
     DirectConnNode *prev = NULL, *cur = user->directConns;
     while(cur) {
-        if(strcmp(cur->username, toUser) == 0) {
+        if(cur->peer == peer) {
             if(prev) prev->next = cur->next;
             else user->directConns = cur->next;
             free(cur);
@@ -135,6 +130,67 @@ void removeDirectConnU(UserNode *user, const char *toUser) {
     }
 }
 
+void addDirectConnU(UserNode *user, UserNode *peer) {
+    if(user == peer) return;
+    linkDirectConn(user, peer);
+    linkDirectConn(peer, user);
+}
+
+void removeDirectConnU(UserNode *user, UserNode *peer) {
+    unlinkDirectConn(user, peer);
+    unlinkDirectConn(peer, user);
+}
+
+// only touches this user's peers, never the whole user list
+void removeAllDirectConnsU(UserNode *user) {
+    DirectConnNode *cur = user->directConns;
+    while(cur) {
+        DirectConnNode *tmp = cur;
+        unlinkDirectConn(cur->peer, user);
+        cur = cur->next;
+        free(tmp);
+    }
+    user->directConns = NULL;
+}
+
+/////////////////// USER INDEX //////////////////////////
+static unsigned int hashName(const char *name) {
+    unsigned int h = 5381;
+    while(*name) h = h * 33 + (unsigned char)*name++;
+    return h % USER_INDEX_SIZE;
+}
+
+void indexUserU(UserIndex *index, UserNode *user) {
+    unsigned int b = hashName(user->username);
+    user->hashNext = index->buckets[b];
+    index->buckets[b] = user;
+}
+
+void unindexUserU(UserIndex *index, UserNode *user) {
+    UserNode **link = &index->buckets[hashName(user->username)];
+    while(*link) {
+        if(*link == user) {
+            *link = user->hashNext;
+            user->hashNext = NULL;
+            return;
+        }
+        link = &(*link)->hashNext;
+    }
+}
+
+UserNode* findUserIndexedU(const UserIndex *index, const char *username) {
+    UserNode *cur = index->buckets[hashName(username)];
+    while(cur) {
+        if(strcmp(cur->username, username) == 0) return cur;
+        cur = cur->hashNext;
+    }
+    return NULL;
+}
+
+void clearUserIndexU(UserIndex *index) {
+    memset(index->buckets, 0, sizeof(index->buckets));
+}
+
 /////////////////// ROOM LIST //////////////////////////
 RoomNode* insertFirstRoom(RoomNode *head, const char *roomname) {
     if(findRoomByNameR(head, roomname)) return head; // prevent duplicate
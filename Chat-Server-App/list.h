@@ -7,6 +7,7 @@
 #include <stdbool.h>
 
 #define MAX_NAME_LEN 50
+#define USER_INDEX_SIZE 256
 
 /////////////////// USER LIST //////////////////////////
 typedef struct UserNode {
@@ -15,6 +16,7 @@ typedef struct UserNode {
     struct RoomListNode *rooms;
     struct DirectConnNode *directConns;
     struct UserNode *next;
+    struct UserNode *hashNext;   // chain in UserIndex bucket
 } UserNode;
 
 typedef struct RoomListNode {
@@ -22,11 +24,17 @@ typedef struct RoomListNode {
     struct RoomListNode *next;
 } RoomListNode;
 
+/* DM relationships are symmetric: each side holds a node pointing at the other */
 typedef struct DirectConnNode {
-    char username[MAX_NAME_LEN];
+    struct UserNode *peer;
     struct DirectConnNode *next;
 } DirectConnNode;
 
+/* Name -> user hash index, kept alongside the user list */
+typedef struct UserIndex {
+    UserNode *buckets[USER_INDEX_SIZE];
+} UserIndex;
+
 /////////////////// ROOM LIST //////////////////////////
 typedef struct RoomNode {
     char name[MAX_NAME_LEN];
@@ -50,8 +58,14 @@ void addRoomToUserU(UserNode *user, const char *roomname);
 void removeRoomFromUserU(UserNode *user, const char *roomname);
 void removeAllRoomsFromUserU(UserNode *user);
 
-void addDirectConnU(UserNode *user, const char *toUser);
-void removeDirectConnU(UserNode *user, const char *toUser);
+void addDirectConnU(UserNode *user, UserNode *peer);
+void removeDirectConnU(UserNode *user, UserNode *peer);
+void removeAllDirectConnsU(UserNode *user);
+
+void indexUserU(UserIndex *index, UserNode *user);
+void unindexUserU(UserIndex *index, UserNode *user);
+UserNode* findUserIndexedU(const UserIndex *index, const char *username);
+void clearUserIndexU(UserIndex *index);
 
 /////////////////// ROOM FUNCTIONS //////////////////////////
 RoomNode* insertFirstRoom(RoomNode *head, const char *roomname);
@@ -3,53 +3,147 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 /* globals */
-int numReaders = 0;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t rw_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 UserNode *user_head = NULL;
 RoomNode *room_head = NULL;
+UserIndex user_index;
 
 const char *server_MOTD = "Thanks for connecting to BisonChat Server.\n\nchat>";
 
-/* reader/writer helpers (exported) */
+/* reader/writer helpers (exported)
+ * Backed by a rwlock: the old scheme had the first reader lock a mutex
+ * that the last reader, possibly another thread, then unlocked. */
 void reader_lock(void) {
-    pthread_mutex_lock(&mutex);
-    numReaders++;
-    if (numReaders == 1) pthread_mutex_lock(&rw_lock);
-    pthread_mutex_unlock(&mutex);
+    pthread_rwlock_rdlock(&rw_lock);
 }
 void reader_unlock(void) {
-    pthread_mutex_lock(&mutex);
-    numReaders--;
-    if (numReaders == 0) pthread_mutex_unlock(&rw_lock);
-    pthread_mutex_unlock(&mutex);
+    pthread_rwlock_unlock(&rw_lock);
 }
 
 /* socket helpers */
-int get_server_socket(void) {
-    int opt = 1;
+/* listeners opened by get_server_socket()/get_unix_server_socket(), kept
+ * so the SIGINT handler closes (and unlinks) exactly these */
+static int tcp_listener = -1;
+static int unix_listener = -1;
+static char unix_listener_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* bind a TCP socket of the given family to PORT; -1 on any failure */
+static int bind_tcp_socket(int family) {
+    int opt = 1, v6only = 0;
     int master_socket;
-    struct sockaddr_in address;
-    if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    struct sockaddr_storage address;
+    socklen_t addrlen;
+    if ((master_socket = socket(family, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         return -1;
     }
-    if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (family == AF_INET6 &&
+         setsockopt(master_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)) {
         perror("setsockopt");
         close(master_socket);
         return -1;
     }
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    memset(&address, 0, sizeof(address));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&address;
+        a6->sin6_family = AF_INET6;
+        a6->sin6_addr = in6addr_any;
+        a6->sin6_port = htons(PORT);
+        addrlen = sizeof(*a6);
+    } else {
+        struct sockaddr_in *a4 = (struct sockaddr_in *)&address;
+        a4->sin_family = AF_INET;
+        a4->sin_addr.s_addr = INADDR_ANY;
+        a4->sin_port = htons(PORT);
+        addrlen = sizeof(*a4);
+    }
+    if (bind(master_socket, (struct sockaddr *)&address, addrlen) < 0) {
+        perror("bind");
+        close(master_socket);
+        return -1;
+    }
+    return master_socket;
+}
+
+/* TCP listener: one dual-stack IPv6 socket also accepts IPv4 clients as
+ * v4-mapped addresses. If IPv6 is missing, disabled, or refuses the
+ * dual-stack options or the bind, fall back to plain IPv4. */
+int get_server_socket(void) {
+    int master_socket = bind_tcp_socket(AF_INET6);
+    if (master_socket < 0) {
+        fprintf(stderr, "IPv6 listener unavailable, falling back to IPv4\n");
+        master_socket = bind_tcp_socket(AF_INET);
+    }
+    if (master_socket >= 0) tcp_listener = master_socket;
+    return master_socket;
+}
+
+/* default Unix socket path: $XDG_RUNTIME_DIR, else /run/user/<uid>, else a
+ * per-user name in /tmp; -1 if it does not fit */
+int get_unix_socket_path(char *out, size_t outlen) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char rundir[64];
+    int n;
+    if (!dir || dir[0] != '/') {
+        snprintf(rundir, sizeof(rundir), "/run/user/%u", (unsigned)getuid());
+        dir = access(rundir, W_OK | X_OK) == 0 ? rundir : NULL;
+    }
+    if (dir) n = snprintf(out, outlen, "%s/%s", dir, UNIX_SOCKET_NAME);
+    else n = snprintf(out, outlen, "/tmp/%u-%s", (unsigned)getuid(), UNIX_SOCKET_NAME);
+    return n < 0 || (size_t)n >= outlen ? -1 : 0;
+}
+
+/* Unix-domain stream listener for co-located bridges and bots; clients on
+ * it go through the same client_receive() as TCP ones. path NULL means
+ * get_unix_socket_path(). An existing socket file is only removed when
+ * nothing accepts on it (ECONNREFUSED); a live server or a non-socket
+ * file makes this fail instead. */
+int get_unix_server_socket(const char *path) {
+    int master_socket;
+    struct sockaddr_un address;
+    struct stat st;
+    char defpath[sizeof(address.sun_path)];
+    if (!path) {
+        if (get_unix_socket_path(defpath, sizeof(defpath)) < 0) return -1;
+        path = defpath;
+    }
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if ((master_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(master_socket, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "%s: another server is already listening\n", path);
+        close(master_socket);
+        return -1;
+    }
+    /* stale socket from a previous run (connect to a plain file also
+     * reports ECONNREFUSED, hence the S_ISSOCK check) */
+    if (errno == ECONNREFUSED && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    close(master_socket);
+
+    if ((master_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
     if (bind(master_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind");
         close(master_socket);
         return -1;
     }
+    unix_listener = master_socket;
+    strcpy(unix_listener_path, path);
     return master_socket;
 }
 
@@ -63,61 +157,81 @@ int accept_client(int serv_sock) {
     return accept(serv_sock, (struct sockaddr *)&addr, &addrlen);
 }
 
+/* wait on several listeners (e.g. TCP and Unix) and accept from whichever
+ * is ready first; -1 on error */
+int accept_any_client(const int *serv_socks, int count) {
+    struct pollfd pfds[8];
+    if (count <= 0 || count > (int)(sizeof(pfds) / sizeof(pfds[0]))) return -1;
+    for (int i = 0; i < count; ++i) {
+        pfds[i].fd = serv_socks[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    while (poll(pfds, count, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (pfds[i].revents & POLLIN) return accept_client(pfds[i].fd);
+    }
+    return -1;
+}
+
 /* safe list ops */
 /* add room (writer) */
 void addRoomSafe(const char *roomname) {
     if (!roomname) return;
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
     room_head = insertFirstRoom(room_head, roomname);
-    pthread_mutex_unlock(&rw_lock);
+    pthread_rwlock_unlock(&rw_lock);
 }
 
-/* add user and join default room (writer) */
+/* add user and join default room (writer). If the name is taken (someone
+ * may have logged in as "guest<fd>") a numeric suffix is appended, so every
+ * socket always gets its own node. */
 void addUserSafe(int socket, const char *username) {
+    char name[MAX_NAME_LEN];
     if (!username) return;
-    pthread_mutex_lock(&rw_lock);
-    user_head = insertFirstUser(user_head, socket, username);
+    pthread_rwlock_wrlock(&rw_lock);
+    snprintf(name, sizeof(name), "%s", username);
+    for (int n = 1; findUserIndexedU(&user_index, name); ++n)
+        snprintf(name, sizeof(name), "%.*s_%d", MAX_NAME_LEN - 12, username, n);
+    user_head = insertFirstUser(user_head, socket, name);
+    UserNode *u = user_head;
+    indexUserU(&user_index, u);
     room_head = insertFirstRoom(room_head, DEFAULT_ROOM);
-    addUserToRoomR(room_head, username, DEFAULT_ROOM);
-    UserNode *u = findUserByNameU(user_head, username);
-    if (u) addRoomToUserU(u, DEFAULT_ROOM);
-    pthread_mutex_unlock(&rw_lock);
+    addUserToRoomR(room_head, name, DEFAULT_ROOM);
+    addRoomToUserU(u, DEFAULT_ROOM);
+    pthread_rwlock_unlock(&rw_lock);
 }
 
 /* add user to room - both directions (writer) */
 void addUserToRoomSafe(const char *username, const char *roomname) {
     if (!username || !roomname) return;
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
     room_head = insertFirstRoom(room_head, roomname);
     addUserToRoomR(room_head, username, roomname);
-    UserNode *u = findUserByNameU(user_head, username);
+    UserNode *u = findUserIndexedU(&user_index, username);
     if (u) addRoomToUserU(u, roomname);
-    pthread_mutex_unlock(&rw_lock);
+    pthread_rwlock_unlock(&rw_lock);
 }
 
 /* remove user->room and room->user (writer) */
 void removeUserFromRoomSafe(const char *username, const char *roomname) {
     if (!username || !roomname) return;
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
     removeUserFromRoomR(room_head, username, roomname);
-    UserNode *u = findUserByNameU(user_head, username);
+    UserNode *u = findUserIndexedU(&user_index, username);
     if (u) removeRoomFromUserU(u, roomname);
-    pthread_mutex_unlock(&rw_lock);
+    pthread_rwlock_unlock(&rw_lock);
 }
 
 /* remove all DCs and memberships (writer) */
 void removeAllUserConnectionsSafe(const char *username) {
     if (!username) return;
-    pthread_mutex_lock(&rw_lock);
-    UserNode *u = findUserByNameU(user_head, username);
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserIndexedU(&user_index, username);
     if (u) {
-        DirectConnNode *dc = u->directConns;
-        while (dc) {
-            DirectConnNode *tmp = dc;
-            dc = dc->next;
-            free(tmp);
-        }
-        u->directConns = NULL;
+        removeAllDirectConnsU(u);
         RoomListNode *rln = u->rooms;
         while (rln) {
             removeUserFromRoomR(room_head, username, rln->roomName);
@@ -125,29 +239,77 @@ void removeAllUserConnectionsSafe(const char *username) {
         }
         removeAllRoomsFromUserU(u);
     }
-    pthread_mutex_unlock(&rw_lock);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+/* copy the name for socket out under the lock (reader); -1 if unknown */
+int getUsernameSafe(int socket, char *out, size_t outlen) {
+    int found = -1;
+    reader_lock();
+    UserNode *u = findUserBySocketU(user_head, socket);
+    if (u) {
+        snprintf(out, outlen, "%s", u->username);
+        found = 0;
+    }
+    reader_unlock();
+    return found;
+}
+
+/* join an existing room (writer); -1 if the room or user is missing */
+int joinRoomSafe(int socket, const char *roomname) {
+    if (!roomname) return -1;
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserBySocketU(user_head, socket);
+    if (!u || !findRoomByNameR(room_head, roomname)) {
+        pthread_rwlock_unlock(&rw_lock);
+        return -1;
+    }
+    addUserToRoomR(room_head, u->username, roomname);
+    addRoomToUserU(u, roomname);
+    pthread_rwlock_unlock(&rw_lock);
+    return 0;
 }
 
 /* remove user by socket (writer) */
 void removeUserSafe(int socket) {
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserBySocketU(user_head, socket);
+    if (u) unindexUserU(&user_index, u);
     removeUserU(&user_head, socket);
-    pthread_mutex_unlock(&rw_lock);
+    pthread_rwlock_unlock(&rw_lock);
+}
+
+/* drop all of a client's state (writer), then close its socket; senders
+ * still holding the fd keep it open until they release it */
+void disconnectClientSafe(int socket) {
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserBySocketU(user_head, socket);
+    if (u) {
+        RoomListNode *rln = u->rooms;
+        while (rln) {
+            removeUserFromRoomR(room_head, u->username, rln->roomName);
+            rln = rln->next;
+        }
+        unindexUserU(&user_index, u);
+        removeUserU(&user_head, socket);
+    }
+    pthread_rwlock_unlock(&rw_lock);
+    client_close(socket);
 }
 
 /* rename user safely and update all references (writer) */
 void renameUserSafe(int socket, const char *newName) {
+    char msg[128];
     if (!newName || strlen(newName) == 0) return;
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
 
     UserNode *u = findUserBySocketU(user_head, socket);
-    if (!u) { pthread_mutex_unlock(&rw_lock); return; }
+    if (!u) { pthread_rwlock_unlock(&rw_lock); return; }
 
-    if (findUserByNameU(user_head, newName)) {
-        char msg[128];
+    if (findUserIndexedU(&user_index, newName)) {
+        pthread_rwlock_unlock(&rw_lock);
         snprintf(msg, sizeof(msg), "Username '%s' is already taken.\nchat>", newName);
-        send(socket, msg, strlen(msg), 0);
-        pthread_mutex_unlock(&rw_lock);
+        client_send(socket, msg, strlen(msg));
         return;
     }
 
@@ -155,8 +317,10 @@ void renameUserSafe(int socket, const char *newName) {
     strncpy(oldName, u->username, MAX_NAME_LEN-1);
     oldName[MAX_NAME_LEN-1] = '\0';
 
+    unindexUserU(&user_index, u);
     strncpy(u->username, newName, MAX_NAME_LEN-1);
     u->username[MAX_NAME_LEN-1] = '\0';
+    indexUserU(&user_index, u);
 
     /* update room members */
     RoomNode *r = room_head;
@@ -172,72 +336,144 @@ void renameUserSafe(int socket, const char *newName) {
         r = r->next;
     }
 
-    /* update direct connections across all users */
-    UserNode *it = user_head;
-    while (it) {
-        DirectConnNode *dc = it->directConns;
-        while (dc) {
-            if (strcmp(dc->username, oldName) == 0) {
-                strncpy(dc->username, newName, MAX_NAME_LEN-1);
-                dc->username[MAX_NAME_LEN-1] = '\0';
-            }
-            dc = dc->next;
-        }
-        it = it->next;
-    }
+    /* direct connections hold node pointers, so nothing else to update */
 
-    char msg[128];
+    pthread_rwlock_unlock(&rw_lock);
+
+    /* reply outside the lock so a client that is not reading cannot stall it */
     snprintf(msg, sizeof(msg), "Logged in as '%s'.\nchat>", newName);
-    send(socket, msg, strlen(msg), 0);
+    client_send(socket, msg, strlen(msg));
+}
+
+/* open a symmetric DM channel with toUser (writer);
+ * -1 if no such user, -2 if toUser is the caller */
+int connectUserSafe(int socket, const char *toUser) {
+    if (!toUser) return -1;
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserBySocketU(user_head, socket);
+    UserNode *target = findUserIndexedU(&user_index, toUser);
+    if (!u || !target) { pthread_rwlock_unlock(&rw_lock); return -1; }
+    if (u == target) { pthread_rwlock_unlock(&rw_lock); return -2; }
+    addDirectConnU(u, target);
+    pthread_rwlock_unlock(&rw_lock);
+    return 0;
+}
+
+/* close the DM channel on both sides (writer); -1 if no such user */
+int disconnectUserSafe(int socket, const char *toUser) {
+    if (!toUser) return -1;
+    pthread_rwlock_wrlock(&rw_lock);
+    UserNode *u = findUserBySocketU(user_head, socket);
+    UserNode *target = findUserIndexedU(&user_index, toUser);
+    if (!u || !target) { pthread_rwlock_unlock(&rw_lock); return -1; }
+    removeDirectConnU(u, target);
+    pthread_rwlock_unlock(&rw_lock);
+    return 0;
+}
+
+/* DM delivery (reader): resolve the target through the name index, confirm
+ * the channel from the target's side and write straight to its socket.
+ * Returns 0 on send, -1 if no such user, -2 if not connected. */
+int sendDirectMessageSafe(int socket, const char *toUser, const char *text, size_t len) {
+    char msg[MAXBUFF + MAX_NAME_LEN + 32];
+    int n, target_sock;
+    if (!toUser || !text) return -1;
+
+    reader_lock();
+    UserNode *target = findUserIndexedU(&user_index, toUser);
+    if (!target) { reader_unlock(); return -1; }
+    DirectConnNode *dc = target->directConns;
+    while (dc && dc->peer->socket != socket) dc = dc->next;
+    if (!dc) { reader_unlock(); return -2; }
+    n = snprintf(msg, sizeof(msg), "\n[DM] %s> %.*s\nchat>", dc->peer->username, (int)len, text);
+    if ((size_t)n >= sizeof(msg)) n = sizeof(msg) - 1;
+    target_sock = target->socket;
+    /* hold the fd so it cannot be closed and reused before the send */
+    if (client_hold(target_sock) < 0) target_sock = -1;
+    reader_unlock();
 
-    pthread_mutex_unlock(&rw_lock);
+    if (target_sock < 0) return -1;
+    client_send(target_sock, msg, (size_t)n);
+    client_release(target_sock);
+    return 0;
+}
+
+/* list functions (reader): the reply is built under the lock and sent
+ * after it is released */
+static void appendLine(char **buf, size_t *len, size_t *cap, const char *line) {
+    size_t n = strlen(line);
+    if (!*buf) return;
+    if (*len + n + 1 > *cap) {
+        size_t ncap = (*cap + n + 1) * 2;
+        char *tmp = realloc(*buf, ncap);
+        if (!tmp) return;
+        *buf = tmp;
+        *cap = ncap;
+    }
+    memcpy(*buf + *len, line, n);
+    *len += n;
+    (*buf)[*len] = '\0';
 }
 
-/* list functions (reader) */
 void listAllRooms(int client_socket) {
-    char buffer[256];
+    char line[MAX_NAME_LEN + 2];
+    size_t len = 0, cap = 256;
+    char *out = malloc(cap);
+    appendLine(&out, &len, &cap, "Rooms list:\n");
     reader_lock();
-    snprintf(buffer, sizeof(buffer), "Rooms list:\n");
-    send(client_socket, buffer, strlen(buffer), 0);
     RoomNode *cur = room_head;
     while (cur) {
-        snprintf(buffer, sizeof(buffer), "%s\n", cur->name);
-        send(client_socket, buffer, strlen(buffer), 0);
+        snprintf(line, sizeof(line), "%s\n", cur->name);
+        appendLine(&out, &len, &cap, line);
         cur = cur->next;
     }
     reader_unlock();
-    send(client_socket, "chat>", 5, 0);
+    appendLine(&out, &len, &cap, "chat>");
+    if (out) client_send(client_socket, out, len);
+    free(out);
 }
 
 void listAllUsers(int client_socket, int requester_socket) {
-    char buffer[256];
+    char line[MAX_NAME_LEN + 2];
+    size_t len = 0, cap = 256;
+    char *out = malloc(cap);
+    (void)requester_socket;
+    appendLine(&out, &len, &cap, "Users list:\n");
     reader_lock();
-    snprintf(buffer, sizeof(buffer), "Users list:\n");
-    send(client_socket, buffer, strlen(buffer), 0);
     UserNode *cur = user_head;
     while (cur) {
-        snprintf(buffer, sizeof(buffer), "%s\n", cur->username);
-        send(client_socket, buffer, strlen(buffer), 0);
+        snprintf(line, sizeof(line), "%s\n", cur->username);
+        appendLine(&out, &len, &cap, line);
         cur = cur->next;
     }
     reader_unlock();
-    send(client_socket, "chat>", 5, 0);
+    appendLine(&out, &len, &cap, "chat>");
+    if (out) client_send(client_socket, out, len);
+    free(out);
 }
 
 /* SIGINT cleanup */
 void sigintHandler(int sig_num) {
     (void)sig_num;
     fprintf(stderr, "\nServer shutting down...\n");
-    pthread_mutex_lock(&rw_lock);
+    pthread_rwlock_wrlock(&rw_lock);
+    /* shutdown only: each client thread owns its fd and closes it itself
+     * once it sees EOF */
     UserNode *u = user_head;
     while (u) {
-        close(u->socket);
+        shutdown(u->socket, SHUT_RDWR);
         u = u->next;
     }
+    clearUserIndexU(&user_index);
     freeAllUsersU(&user_head);
     freeAllRoomsR(&room_head);
-    pthread_mutex_unlock(&rw_lock);
-    close(get_server_socket()); /* optional: close server socket; safe */
+    pthread_rwlock_unlock(&rw_lock);
+    tls_shutdown();
+    if (tcp_listener >= 0) close(tcp_listener);
+    if (unix_listener >= 0) {
+        close(unix_listener);
+        unlink(unix_listener_path);
+    }
     fprintf(stderr, "All resources freed. Exiting.\n");
     exit(0);
 }
@@ -14,16 +14,16 @@
 
 /* local */
 #include "list.h"
+#include "tls.h"
 
 #define PORT 8888
+#define UNIX_SOCKET_NAME "bisonchat.sock"  // placed by get_unix_socket_path()
 #define BACKLOG 5
 #define DEFAULT_ROOM "Lobby"
 #define MAXBUFF 2048
 
 /* Reader/Writer globals (declared in server.c) */
-extern int numReaders;
-extern pthread_mutex_t mutex;     // protects numReaders
-extern pthread_mutex_t rw_lock;   // writer lock
+extern pthread_rwlock_t rw_lock;  // guards user_head, room_head, user_index
 
 /* reader lock helpers (defined in server.c) */
 void reader_lock(void);
@@ -35,11 +35,15 @@ extern const char *server_MOTD;
 /* Global heads */
 extern UserNode *user_head;
 extern RoomNode *room_head;
+extern UserIndex user_index;
 
 /* Core functions */
 int get_server_socket(void);
+int get_unix_socket_path(char *out, size_t outlen);
+int get_unix_server_socket(const char *path);
 int start_server(int serv_socket, int backlog);
 int accept_client(int serv_sock);
+int accept_any_client(const int *serv_socks, int count);
 void sigintHandler(int sig_num);
 void *client_receive(void *ptr);
 
@@ -50,7 +54,13 @@ void addUserToRoomSafe(const char *username, const char *roomname);
 void removeUserFromRoomSafe(const char *username, const char *roomname);
 void removeAllUserConnectionsSafe(const char *username);
 void removeUserSafe(int socket);
+void disconnectClientSafe(int socket);
+int getUsernameSafe(int socket, char *out, size_t outlen);
+int joinRoomSafe(int socket, const char *roomname);
 void renameUserSafe(int socket, const char *newName);
+int connectUserSafe(int socket, const char *toUser);
+int disconnectUserSafe(int socket, const char *toUser);
+int sendDirectMessageSafe(int socket, const char *toUser, const char *text, size_t len);
 void listAllRooms(int client_socket);
 void listAllUsers(int client_socket, int requester_socket);
 
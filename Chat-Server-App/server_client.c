@@ -5,187 +5,346 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-extern int numReaders;
-extern pthread_mutex_t mutex;
-extern pthread_mutex_t rw_lock;
+extern pthread_rwlock_t rw_lock;
 extern UserNode *user_head;
 extern RoomNode *room_head;
 extern const char *server_MOTD;
 
 #define DEFAULT_ROOM "Lobby"
 #define MAX_ARGS 80
+#define MAX_LINES 64   // newline offsets reported per sanitizeMessage call
 
-static char *trimwhitespace(char *str) {
-    char *end;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
+/* Length of the well-formed UTF-8 sequence at s, or 0 if it is malformed,
+ * overlong, a surrogate, out of range or truncated. */
+static size_t utf8SequenceLength(const unsigned char *s, size_t avail) {
+    size_t n;
+    unsigned int cp;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) { n = 2; cp = s[0] & 0x1f; }
+    else if ((s[0] & 0xf0) == 0xe0) { n = 3; cp = s[0] & 0x0f; }
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4) { n = 4; cp = s[0] & 0x07; }
+    else return 0;
+    if (n > avail) return 0;
+    for (size_t k = 1; k < n; ++k) {
+        if ((s[k] & 0xc0) != 0x80) return 0;
+        cp = (cp << 6) | (s[k] & 0x3f);
+    }
+    if (n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) return 0;
+    if (n == 4 && (cp < 0x10000 || cp > 0x10ffff)) return 0;
+    return n;
+}
+
+/* True if s is the start of a multi-byte sequence cut off by the end of
+ * the buffer; the rest may still arrive with the next read. */
+static int utf8IsTruncated(const unsigned char *s, size_t avail) {
+    size_t n;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) n = 2;
+    else if ((s[0] & 0xf0) == 0xe0) n = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4) n = 4;
+    else return 0;
+    if (n <= avail) return 0;
+    for (size_t k = 1; k < avail; ++k)
+        if ((s[k] & 0xc0) != 0x80) return 0;
+    return 1;
+}
+
+/* Printable-ASCII run scanners: copy bytes from in to dst while they are in
+ * 0x20..0x7e and return how many were copied. They store whole blocks, so
+ * dst must have as much room as in. */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t printableRunAVX2(char *dst, const unsigned char *in, size_t avail) {
+    size_t run = 0;
+    while (avail - run >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + run));
+        /* signed compare flags both < 0x20 and >= 0x80 */
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(bad);
+        _mm256_storeu_si256((__m256i *)(dst + run), v);
+        if (mask) return run + (size_t)__builtin_ctz(mask);
+        run += 32;
+    }
+    return run;
+}
+#endif
+
+#if defined(__SSE2__)
+static size_t printableRunSSE2(char *dst, const unsigned char *in, size_t avail) {
+    size_t run = 0;
+    while (avail - run >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + run));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(bad);
+        _mm_storeu_si128((__m128i *)(dst + run), v);
+        if (mask) return run + (size_t)__builtin_ctz(mask);
+        run += 16;
+    }
+    return run;
+}
+#endif
+
+static size_t printableRun(char *dst, const unsigned char *in, size_t avail) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) return printableRunAVX2(dst, in, avail);
+#endif
+#if defined(__SSE2__)
+    return printableRunSSE2(dst, in, avail);
+#else
+    (void)dst; (void)in; (void)avail;
+    return 0;
+#endif
+}
+
+/* Single pass over incoming bytes: copies src into dst, drops control
+ * characters (tab and newline are kept) and replaces malformed UTF-8 with
+ * '?'. The dst offset of every newline is stored in newlines[]; the scan
+ * stops after maxNewlines of them, or before a multi-byte sequence cut off
+ * at the end of src. *consumed says how much of src was used.
+ * dst must hold len bytes. Returns the number of bytes written. */
+static size_t sanitizeMessage(char *dst, const char *src, size_t len,
+                              size_t *newlines, size_t maxNewlines,
+                              size_t *numNewlines, size_t *consumed) {
+    const unsigned char *in = (const unsigned char *)src;
+    size_t i = 0, out = 0, nl = 0;
+
+    while (i < len) {
+        size_t run = printableRun(dst + out, in + i, len - i); /* out <= i */
+        out += run;
+        i += run;
+        if (i == len) break;
+
+        unsigned char c = in[i];
+        if (c < 0x80) {
+            if ((c >= 0x20 && c != 0x7f) || c == '\t') dst[out++] = (char)c;
+            else if (c == '\n') {
+                newlines[nl++] = out;
+                dst[out++] = '\n';
+                if (nl == maxNewlines) { i++; break; }
+            }
+            i++;
+            continue;
+        }
+        size_t n = utf8SequenceLength(in + i, len - i);
+        if (n) {
+            memcpy(dst + out, in + i, n);
+            out += n;
+            i += n;
+        } else if (utf8IsTruncated(in + i, len - i)) {
+            break;
+        } else {
+            dst[out++] = '?';
+            i++;
+        }
+    }
+    *numNewlines = nl;
+    *consumed = i;
+    return out;
+}
+
+static int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
 }
 
-/* Broadcast: collect recipients under reader lock then send outside lock */
-static void broadcastMessage(UserNode *sender, const char *message) {
-    if (!sender || !message) return;
+/* Broadcast room traffic: collect recipients under reader lock then send
+ * outside lock. Recipients come from the member lists of the sender's
+ * rooms, resolved through the name index, so the cost follows the size of
+ * those rooms rather than users x rooms; someone sharing two rooms with
+ * the sender is dropped by the sort/unique pass. Each recipient fd is held
+ * (client_hold) while collected, so it cannot be closed and reused before
+ * the send; a slow recipient only delays this sender, never the lock.
+ * DMs go through sendDirectMessageSafe instead. */
+static void broadcastMessage(int sender_sock, const char *message, size_t len) {
+    if (!message) return;
 
-    int cap = 16, count = 0;
+    int cap = 16, count = 0, held = 0;
     int *socks = malloc(sizeof(int) * cap);
     if (!socks) return;
 
     reader_lock();
-    UserNode *cur = user_head;
-    while (cur) {
-        if (cur->socket != sender->socket) {
-            int sendFlag = 0;
-            RoomListNode *rln = sender->rooms;
-            while (rln && !sendFlag) {
-                if (findRoomByNameR(room_head, rln->roomName)) {
-                    if (userIsInRoomUnlocked(cur->username, rln->roomName)) sendFlag = 1;
-                }
-                rln = rln->next;
-            }
-            DirectConnNode *dc = sender->directConns;
-            while (dc && !sendFlag) {
-                if (strcmp(dc->username, cur->username) == 0) sendFlag = 1;
-                dc = dc->next;
-            }
-            if (sendFlag) {
-                if (count >= cap) {
-                    cap *= 2;
-                    int *tmp = realloc(socks, sizeof(int) * cap);
-                    if (!tmp) break;
-                    socks = tmp;
-                }
-                socks[count++] = cur->socket;
+    UserNode *sender = findUserBySocketU(user_head, sender_sock);
+    for (RoomListNode *rln = sender ? sender->rooms : NULL; rln; rln = rln->next) {
+        RoomNode *room = findRoomByNameR(room_head, rln->roomName);
+        for (RoomUserNode *ru = room ? room->users : NULL; ru; ru = ru->next) {
+            UserNode *cur = findUserIndexedU(&user_index, ru->username);
+            if (!cur || cur->socket == sender->socket) continue;
+            if (count >= cap) {
+                int *tmp = realloc(socks, sizeof(int) * cap * 2);
+                if (!tmp) break;
+                socks = tmp;
+                cap *= 2;
             }
+            socks[count++] = cur->socket;
         }
-        cur = cur->next;
+    }
+    qsort(socks, count, sizeof(int), compareInts);
+    for (int i = 0, prev = -1; i < count; ++i) {
+        int sock = socks[i];
+        if (sock == prev) continue;
+        prev = sock;
+        if (client_hold(sock) == 0) socks[held++] = sock;
     }
     reader_unlock();
 
-    for (int i = 0; i < count; ++i) {
-        send(socks[i], message, strlen(message), 0);
+    for (int i = 0; i < held; ++i) {
+        client_send(socks[i], message, len);
+        client_release(socks[i]);
     }
     free(socks);
 }
 
-/* Utility used above: check membership without locking (caller must hold lock) */
-static int userIsInRoomUnlocked(const char *username, const char *roomname) {
-    RoomNode *r = findRoomByNameR(room_head, roomname);
-    if (!r) return 0;
-    RoomUserNode *ru = r->users;
-    while (ru) {
-        if (strcmp(ru->username, username) == 0) return 1;
-        ru = ru->next;
+/* Run one sanitised, newline-free command line. line is modified in
+ * place. Returns -1 when the client asked to exit. */
+static int handleLine(int client, char *line, size_t linelen) {
+    char buffer[MAXBUFF], tmpbuf[MAXBUFF], cmd[MAXBUFF], username[MAX_NAME_LEN];
+    char *arguments[MAX_ARGS], *saveptr;
+    const char *delimiters = " \t\n\r";
+
+    while (linelen > 0 && (line[linelen-1] == ' ' || line[linelen-1] == '\t')) linelen--;
+    line[linelen] = '\0';
+    memcpy(cmd, line, linelen + 1);
+
+    arguments[0] = strtok_r(cmd, delimiters, &saveptr);
+    int i = 0;
+    while (arguments[i] != NULL && i < MAX_ARGS-1) {
+        arguments[++i] = strtok_r(NULL, delimiters, &saveptr);
+    }
+
+    if (!arguments[0]) { client_send(client, "\nchat>", 6); return 0; }
+
+    if (strcmp(arguments[0], "create") == 0 && arguments[1]) {
+        addRoomSafe(arguments[1]);
+        snprintf(buffer, sizeof(buffer), "Room '%s' created.\nchat>", arguments[1]);
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "join") == 0 && arguments[1]) {
+        if (joinRoomSafe(client, arguments[1]) == 0)
+            snprintf(buffer, sizeof(buffer), "Joined room '%s'.\nchat>", arguments[1]);
+        else snprintf(buffer, sizeof(buffer), "Room '%s' does not exist.\nchat>", arguments[1]);
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "leave") == 0 && arguments[1]) {
+        if (getUsernameSafe(client, username, sizeof(username)) == 0) {
+            removeUserFromRoomSafe(username, arguments[1]);
+            snprintf(buffer, sizeof(buffer), "Left room '%s'.\nchat>", arguments[1]);
+        } else snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "connect") == 0 && arguments[1]) {
+        int rc = connectUserSafe(client, arguments[1]);
+        if (rc == 0) snprintf(buffer, sizeof(buffer), "Connected (DM) with '%s'.\nchat>", arguments[1]);
+        else if (rc == -2) snprintf(buffer, sizeof(buffer), "You cannot connect to yourself.\nchat>");
+        else snprintf(buffer, sizeof(buffer), "User '%s' not found.\nchat>", arguments[1]);
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "disconnect") == 0 && arguments[1]) {
+        if (disconnectUserSafe(client, arguments[1]) == 0)
+            snprintf(buffer, sizeof(buffer), "Disconnected from '%s'.\nchat>", arguments[1]);
+        else snprintf(buffer, sizeof(buffer), "User '%s' not found.\nchat>", arguments[1]);
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "msg") == 0 && arguments[1] && arguments[2]) {
+        /* text is the rest of the sanitised line, same offsets as cmd */
+        size_t off = (size_t)(arguments[2] - cmd);
+        int rc = sendDirectMessageSafe(client, arguments[1], line + off, linelen - off);
+        if (rc == 0) snprintf(buffer, sizeof(buffer), "chat>");
+        else if (rc == -2) snprintf(buffer, sizeof(buffer), "Not connected with '%s'. Use connect first.\nchat>", arguments[1]);
+        else snprintf(buffer, sizeof(buffer), "User '%s' not found.\nchat>", arguments[1]);
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "rooms") == 0) {
+        listAllRooms(client);
+    }
+    else if (strcmp(arguments[0], "users") == 0) {
+        listAllUsers(client, client);
+    }
+    else if (strcmp(arguments[0], "login") == 0 && arguments[1]) {
+        renameUserSafe(client, arguments[1]);
+    }
+    else if (strcmp(arguments[0], "help") == 0) {
+        snprintf(buffer, sizeof(buffer), "Commands:\nlogin <username>\ncreate <room>\njoin <room>\nleave <room>\nusers\nrooms\nconnect <user>\ndisconnect <user>\nmsg <user> <text>\nexit\n");
+        client_send(client, buffer, strlen(buffer));
+    }
+    else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0) {
+        return -1;
+    }
+    else {
+        if (getUsernameSafe(client, username, sizeof(username)) == 0) {
+            int n = snprintf(tmpbuf, sizeof(tmpbuf), "\n::%s> %s\nchat>", username, line);
+            if (n < 0) n = 0;
+            if ((size_t)n >= sizeof(tmpbuf)) n = sizeof(tmpbuf) - 1;
+            broadcastMessage(client, tmpbuf, (size_t)n);
+        }
     }
     return 0;
 }
 
 void *client_receive(void *ptr) {
     int client = *(int *)ptr;
-    int received;
-    char buffer[MAXBUFF], sbuffer[MAXBUFF];
-    char tmpbuf[MAXBUFF], cmd[MAXBUFF], username[MAX_NAME_LEN];
-    char *arguments[MAX_ARGS];
-    const char *delimiters = " \t\n\r";
+    int received, done = 0;
+    char raw[MAXBUFF], text[MAXBUFF], username[MAX_NAME_LEN];
+    size_t rawlen = 0;    // carried bytes of a UTF-8 sequence split by read()
+    size_t textlen = 0;   // sanitised start of a line still waiting for '\n'
+    size_t newlines[MAX_LINES];
 
-    send(client, server_MOTD, strlen(server_MOTD), 0);
+    if (client_open(client) < 0) {
+        close(client);
+        return NULL;
+    }
+
+    /* no-op unless the server was started with tls_init() */
+    if (tls_accept_client(client) < 0) {
+        client_close(client);
+        return NULL;
+    }
+
+    client_send(client, server_MOTD, strlen(server_MOTD));
 
     snprintf(username, sizeof(username), "guest%d", client);
 
     addUserSafe(client, username);
 
-    while (1) {
-        if ((received = read(client, buffer, MAXBUFF)) > 0) {
-            buffer[received] = '\0';
-            strncpy(cmd, buffer, sizeof(cmd)-1); cmd[sizeof(cmd)-1] = '\0';
-            strncpy(sbuffer, buffer, sizeof(sbuffer)-1); sbuffer[sizeof(sbuffer)-1] = '\0';
-
-            arguments[0] = strtok(cmd, delimiters);
-            int i = 0;
-            while (arguments[i] != NULL && i < MAX_ARGS-1) {
-                arguments[++i] = strtok(NULL, delimiters);
-                if (arguments[i]) arguments[i] = trimwhitespace(arguments[i]);
-            }
+    while (!done && (received = client_read(client, raw + rawlen, sizeof(raw) - 1 - rawlen)) > 0) {
+        size_t avail = rawlen + (size_t)received, off = 0;
 
-            if (!arguments[0]) { send(client, "\nchat>", 6, 0); continue; }
-
-            if (strcmp(arguments[0], "create") == 0 && arguments[1]) {
-                addRoomSafe(arguments[1]);
-                snprintf(buffer, sizeof(buffer), "Room '%s' created.\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
-            }
-            else if (strcmp(arguments[0], "join") == 0 && arguments[1]) {
-                UserNode *u = findUserBySocketU(user_head, client);
-                RoomNode *r = findRoomByNameR(room_head, arguments[1]);
-                if (u && r) {
-                    addUserToRoomSafe(u->username, arguments[1]);
-                    snprintf(buffer, sizeof(buffer), "Joined room '%s'.\nchat>", arguments[1]);
-                } else snprintf(buffer, sizeof(buffer), "Room '%s' does not exist.\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
-            }
-            else if (strcmp(arguments[0], "leave") == 0 && arguments[1]) {
-                UserNode *u = findUserBySocketU(user_head, client);
-                if (u) {
-                    removeUserFromRoomSafe(u->username, arguments[1]);
-                    snprintf(buffer, sizeof(buffer), "Left room '%s'.\nchat>", arguments[1]);
-                } else snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
-                send(client, buffer, strlen(buffer), 0);
+        while (!done && off < avail) {
+            size_t nl, consumed, start = textlen, lineStart = 0;
+            size_t room = sizeof(text) - 1 - textlen;
+            size_t take = avail - off < room ? avail - off : room;
+            /* a line longer than the buffer is cut and run as it stands,
+             * but only once text is full and holds no newline */
+            if (room == 0) {
+                done = handleLine(client, text, textlen) < 0;
+                textlen = 0;
+                continue;
             }
-            else if (strcmp(arguments[0], "connect") == 0 && arguments[1]) {
-                UserNode *u = findUserBySocketU(user_head, client);
-                UserNode *target = findUserByNameU(user_head, arguments[1]);
-                if (u && target) {
-                    pthread_mutex_lock(&rw_lock);
-                    addDirectConnU(u, target->username);
-                    pthread_mutex_unlock(&rw_lock);
-                    snprintf(buffer, sizeof(buffer), "Connected (DM) with '%s'.\nchat>", target->username);
-                } else snprintf(buffer, sizeof(buffer), "User '%s' not found.\nchat>", arguments[1]);
-                send(client, buffer, strlen(buffer), 0);
+            textlen += sanitizeMessage(text + textlen, raw + off, take,
+                                       newlines, MAX_LINES, &nl, &consumed);
+            for (size_t k = 0; k < nl && !done; ++k) {
+                size_t lineEnd = start + newlines[k];
+                done = handleLine(client, text + lineStart, lineEnd - lineStart) < 0;
+                lineStart = lineEnd + 1;
             }
-            else if (strcmp(arguments[0], "disconnect") == 0 && arguments[1]) {
-                UserNode *u = findUserBySocketU(user_head, client);
-                if (u) {
-                    pthread_mutex_lock(&rw_lock);
-                    removeDirectConnU(u, arguments[1]);
-                    pthread_mutex_unlock(&rw_lock);
-                    snprintf(buffer, sizeof(buffer), "Disconnected from '%s'.\nchat>", arguments[1]);
-                } else snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
-                send(client, buffer, strlen(buffer), 0);
+            memmove(text, text + lineStart, textlen - lineStart);
+            textlen -= lineStart;
+            off += consumed;
+            if (consumed == 0) {
+                if (take == avail - off) break; /* truncated UTF-8 sequence, wait for the rest */
+                /* a multi-byte sequence does not fit the space left: cut the line here */
+                done = handleLine(client, text, textlen) < 0;
+                textlen = 0;
             }
-            else if (strcmp(arguments[0], "rooms") == 0) {
-                listAllRooms(client);
-            }
-            else if (strcmp(arguments[0], "users") == 0) {
-                listAllUsers(client, client);
-            }
-            else if (strcmp(arguments[0], "login") == 0 && arguments[1]) {
-                renameUserSafe(client, arguments[1]);
-            }
-            else if (strcmp(arguments[0], "help") == 0) {
-                snprintf(buffer, sizeof(buffer), "Commands:\nlogin <username>\ncreate <room>\njoin <room>\nleave <room>\nusers\nrooms\nconnect <user>\ndisconnect <user>\nexit\n");
-                send(client, buffer, strlen(buffer), 0);
-            }
-            else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0) {
-                UserNode *u = findUserBySocketU(user_head, client);
-                if (u) {
-                    removeAllUserConnectionsSafe(u->username);
-                    removeUserSafe(client);
-                }
-                close(client);
-                pthread_exit(NULL);
-            }
-            else {
-                UserNode *sender = findUserBySocketU(user_head, client);
-                if (sender) {
-                    snprintf(tmpbuf, sizeof(tmpbuf), "\n::%s> %s\nchat>", sender->username, sbuffer);
-                    broadcastMessage(sender, tmpbuf);
-                }
-            }
-            memset(buffer, 0, sizeof(buffer));
         }
+        memmove(raw, raw + off, avail - off);
+        rawlen = avail - off;
     }
+
+    /* exit command, EOF or read error: drop the user and the connection */
+    disconnectClientSafe(client);
     return NULL;
 }
@@ -0,0 +1,235 @@
+/* Input framing test.
+ *
+ * Two real client_receive() threads on socketpairs, both in the Lobby: the
+ * sender's input is written in shapes that put read() boundaries inside
+ * lines, and the receiver must see every chat line exactly as sent:
+ *   pipelined   many short lines in one write()
+ *   split       a long partial line, then its tail plus another line
+ *   utf8        a multi-byte character split across two writes
+ *   near-full   lines just under the line buffer, pipelined
+ *
+ * usage: framing
+ * Built by `make test` under ThreadSanitizer and AddressSanitizer. */
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+
+#define TIMEOUT_MS 10000
+#define PIPELINED 100
+#define PIPELINED_LEN 99
+#define NEARFULL 8
+#define NEARFULL_LEN (MAXBUFF - 64)   // room for the "\n::name> " prefix
+
+typedef struct Peer {
+    int fd;          // driver end of the socketpair
+    int serverFd;    // client_receive end
+    pthread_t thread;
+    char *stream;    // everything received so far
+    size_t len, cap;
+} Peer;
+
+static int failures = 0;
+
+/* read whatever arrives within timeout_ms; 1 data, 0 timeout, -1 EOF */
+static int pump(Peer *p, int timeout_ms) {
+    struct pollfd pfd = { .fd = p->fd, .events = POLLIN, .revents = 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+    if (p->len + 4096 + 1 > p->cap) {
+        p->cap = (p->cap + 4096 + 1) * 2;
+        p->stream = realloc(p->stream, p->cap);
+    }
+    ssize_t n = read(p->fd, p->stream + p->len, 4096);
+    if (n <= 0) return -1;
+    p->len += (size_t)n;
+    p->stream[p->len] = '\0';
+    return 1;
+}
+
+static void writeAll(Peer *p, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(p->fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("write"); exit(2); }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* send one command and wait until the reply ends in a prompt */
+static void command(Peer *p, const char *line) {
+    size_t mark = p->len;
+    writeAll(p, line, strlen(line));
+    while (!strstr(p->stream + mark, "chat>")) {
+        if (pump(p, TIMEOUT_MS) <= 0) { fprintf(stderr, "no reply to %s", line); exit(1); }
+    }
+}
+
+static void openPeer(Peer *p) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); exit(2); }
+    p->fd = sv[0];
+    p->serverFd = sv[1];
+    p->cap = 4096;
+    p->len = 0;
+    p->stream = malloc(p->cap);
+    p->stream[0] = '\0';
+    if (pthread_create(&p->thread, NULL, client_receive, &p->serverFd) != 0) { perror("pthread_create"); exit(2); }
+    while (!strstr(p->stream, "chat>")) {
+        if (pump(p, TIMEOUT_MS) <= 0) { fprintf(stderr, "no MOTD\n"); exit(1); }
+    }
+    /* the MOTD goes out before the user is added; a reply to a command
+     * means it is in the Lobby */
+    command(p, "rooms\n");
+}
+
+static void closePeer(Peer *p) {
+    writeAll(p, "exit\n", 5);
+    while (pump(p, TIMEOUT_MS) > 0) ;
+    pthread_join(p->thread, NULL);
+    close(p->fd);
+    free(p->stream);
+}
+
+/* collect the chat lines from "sender" that arrived after mark; each
+ * broadcast is "\n::sender> text\nchat>". Waits until want have arrived. */
+static int collect(Peer *rx, size_t mark, int want, char **lines) {
+    int got = 0;
+    while (1) {
+        got = 0;
+        const char *p = rx->stream + mark;
+        while ((p = strstr(p, "\n::sender> ")) != NULL) {
+            const char *text = p + 11;
+            const char *end = strchr(text, '\n');
+            if (!end) break;
+            if (got < want) lines[got] = strndup(text, (size_t)(end - text));
+            got++;
+            p = end;
+        }
+        if (got >= want) {
+            /* anything arriving now is an extra, split message */
+            if (pump(rx, 300) == 0) break;
+        } else if (pump(rx, TIMEOUT_MS) <= 0) {
+            break;
+        }
+        for (int i = 0; i < got && i < want; ++i) free(lines[i]);
+    }
+    return got;
+}
+
+static void expectLines(const char *name, Peer *rx, size_t mark, int want, char **expected) {
+    char **lines = calloc((size_t)want, sizeof(char *));
+    int got = collect(rx, mark, want, lines);
+    int bad = 0;
+    if (got != want) {
+        fprintf(stderr, "%s: received %d messages, expected %d\n", name, got, want);
+        bad = 1;
+    }
+    for (int i = 0; i < want && i < got; ++i) {
+        if (strcmp(lines[i], expected[i]) != 0 && bad++ < 5) {
+            fprintf(stderr, "%s: message %d is %zu bytes, expected %zu\n",
+                    name, i, strlen(lines[i]), strlen(expected[i]));
+        }
+        free(lines[i]);
+    }
+    free(lines);
+    failures += bad != 0;
+    printf("%s: %s\n", name, bad ? "FAIL" : "ok");
+}
+
+static char *repeated(char c, size_t n) {
+    char *s = malloc(n + 1);
+    memset(s, c, n);
+    s[n] = '\0';
+    return s;
+}
+
+int main(void) {
+    Peer tx, rx;
+    char *expected[PIPELINED];
+    size_t mark;
+
+    openPeer(&rx);
+    openPeer(&tx);
+    command(&tx, "login sender\n");
+
+    /* pipelined: PIPELINED lines in a single write */
+    {
+        size_t linelen = PIPELINED_LEN + 1;
+        char *buf = malloc(PIPELINED * linelen);
+        for (int i = 0; i < PIPELINED; ++i) {
+            char *line = buf + i * linelen;
+            memset(line, 'a' + i % 26, PIPELINED_LEN);
+            line[0] = '0' + i / 10 % 10;
+            line[1] = '0' + i % 10;
+            line[PIPELINED_LEN] = '\n';
+            expected[i] = strndup(line, PIPELINED_LEN);
+        }
+        mark = rx.len;
+        writeAll(&tx, buf, PIPELINED * linelen);
+        expectLines("pipelined", &rx, mark, PIPELINED, expected);
+        for (int i = 0; i < PIPELINED; ++i) free(expected[i]);
+        free(buf);
+    }
+
+    /* split: 1500-byte partial line, then its last 400 bytes plus a line */
+    {
+        char *head = repeated('x', 1500), *tail = repeated('y', 400);
+        char *second = repeated('z', 300);
+        char buf[1024];
+        expected[0] = malloc(1901);
+        snprintf(expected[0], 1901, "%s%s", head, tail);
+        expected[1] = second;
+        mark = rx.len;
+        writeAll(&tx, head, 1500);
+        usleep(100 * 1000); /* let the server read the partial line alone */
+        int n = snprintf(buf, sizeof(buf), "%s\n%s\n", tail, second);
+        writeAll(&tx, buf, (size_t)n);
+        expectLines("split", &rx, mark, 2, expected);
+        free(expected[0]);
+        free(head);
+        free(tail);
+        free(second);
+    }
+
+    /* utf8: a 3-byte character cut after its first byte */
+    {
+        static const char euro[] = "\xe2\x82\xac";
+        expected[0] = "price 5\xe2\x82\xac";
+        mark = rx.len;
+        writeAll(&tx, "price 5", 7);
+        writeAll(&tx, euro, 1);
+        usleep(100 * 1000);
+        writeAll(&tx, euro + 1, 2);
+        writeAll(&tx, "\n", 1);
+        expectLines("utf8", &rx, mark, 1, expected);
+    }
+
+    /* near-full: lines just under the buffer, several per write */
+    {
+        size_t linelen = NEARFULL_LEN + 1;
+        char *buf = malloc(NEARFULL * linelen);
+        for (int i = 0; i < NEARFULL; ++i) {
+            char *line = buf + i * linelen;
+            memset(line, 'A' + i, NEARFULL_LEN);
+            line[NEARFULL_LEN] = '\n';
+            expected[i] = strndup(line, NEARFULL_LEN);
+        }
+        mark = rx.len;
+        writeAll(&tx, buf, NEARFULL * linelen);
+        expectLines("near-full", &rx, mark, NEARFULL, expected);
+        for (int i = 0; i < NEARFULL; ++i) free(expected[i]);
+        free(buf);
+    }
+
+    closePeer(&tx);
+    closePeer(&rx);
+
+    pthread_rwlock_wrlock(&rw_lock);
+    clearUserIndexU(&user_index);
+    freeAllUsersU(&user_head);
+    freeAllRoomsR(&room_head);
+    pthread_rwlock_unlock(&rw_lock);
+
+    printf("framing: %d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,452 @@
+/* Stress and concurrency test.
+ *
+ * Runs the real client_receive() threads in-process, each on one end of a
+ * socketpair, and drives scripted bots on the other end in waves:
+ *   A  read MOTD, rename churn, login bot<id>
+ *   B  create/join own room, tmp room churn, list users/rooms, odd bots
+ *      leave Lobby, connect (DM) to the next bot
+ *   C  every bot chats "MSG<id>#" and DMs "DM<id>#" to the next bot
+ *   E  burst: BURST_SENDERS bots chat long lines into their own rooms,
+ *      BURST_READERS bots in all of those rooms read them slowly. Readers
+ *      sit on loopback TCP with small buffers (a socketpair never takes
+ *      part of a message), so the server's sends to them go short while
+ *      several senders contend for each fd
+ *   D  exit, wait for EOF
+ * and checks that each bot receives every room message it should exactly
+ * once (no loss, no duplicates, nothing from outside its rooms), every DM
+ * exactly once, and that the server lists are empty after each wave.
+ * Every token carries a payload ("<tag><id>#aaaa...$") that must arrive
+ * unbroken, so bytes of one message landing inside another are caught.
+ *
+ * usage: stress [total_clients [clients_per_wave]]
+ * The default runs DEFAULT_WAVE clients at once (a server and a driver
+ * thread each), twice. Larger waves work (2000 at once passes under ASan)
+ * but ThreadSanitizer keeps over a megabyte per thread, so 4000 threads
+ * need more than 6 GB. Built by `make test` under ThreadSanitizer and
+ * AddressSanitizer with a long CLIENT_SEND_TIMEOUT_MS: on a loaded
+ * machine a bot can go unscheduled for longer than the production
+ * timeout, and the server would rightly drop it. A drop still shows up
+ * as its own failure, not as lost messages. */
+#define _GNU_SOURCE  // memrchr
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CLIENTS 2000
+#define DEFAULT_WAVE 1000
+#define ROOMS 8
+#define TIMEOUT_MS 30000
+#define LINGER_MS 300
+#define THREAD_STACK (512 * 1024)
+#define SHORT_PAYLOAD 16
+#define BURST_SENDERS 4
+#define BURST_READERS 8
+#define BURST_LINES 64
+#define BURST_PAYLOAD 1500
+#define SLOW_READ 256        // bytes per read for slow readers
+#define SLOW_DELAY_US 200    // pause before each slow read
+#define SLOW_BUFFER 8192     // socket buffers on the burst readers' TCP links
+
+typedef struct Bot {
+    int id;          // global id, name is bot<id>
+    int idx;         // position in the wave
+    int fd;          // driver end of the socketpair
+    char *stream;    // everything received so far
+    size_t len, cap;
+    size_t prompts;  // "chat>" prompts seen
+    size_t scanned;  // stream offset prompts were counted up to
+    size_t parsed;   // stream offset tokens were counted up to
+    int slow;        // read in small, delayed chunks
+    int failed;
+} Bot;
+
+/* expected "<tag><id>#" tokens with ids in [base, base + n) */
+typedef struct Tally {
+    const char *tag;
+    int base, n;
+    size_t payload;
+    int *counts;
+} Tally;
+
+static pthread_barrier_t barrier;
+static int waveBase, waveSize;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static int failures = 0;
+static long checked = 0;
+static int tcpListener = -1;
+static struct sockaddr_in tcpAddr;
+
+static void fail(Bot *b, const char *fmt, ...) {
+    va_list ap;
+    pthread_mutex_lock(&report_lock);
+    failures++;
+    fprintf(stderr, "bot%d: ", b->id);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    pthread_mutex_unlock(&report_lock);
+    b->failed = 1;
+}
+
+/* read whatever arrives within timeout_ms; 1 data, 0 timeout, -1 EOF */
+static int pump(Bot *b, int timeout_ms) {
+    struct pollfd pfd = { .fd = b->fd, .events = POLLIN, .revents = 0 };
+    size_t chunk = b->slow ? SLOW_READ : 4096;
+    if (b->slow) usleep(SLOW_DELAY_US);
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+    if (b->len + chunk + 1 > b->cap) {
+        b->cap = (b->cap + chunk + 1) * 2;
+        b->stream = realloc(b->stream, b->cap);
+    }
+    ssize_t n = read(b->fd, b->stream + b->len, chunk);
+    if (n <= 0) return -1;
+    b->len += (size_t)n;
+    b->stream[b->len] = '\0';
+
+    size_t from = b->scanned > 4 ? b->scanned - 4 : 0;
+    const char *p = b->stream + from;
+    while ((p = strstr(p, "chat>")) != NULL) {
+        if ((size_t)(p - b->stream) >= b->scanned) b->prompts++;
+        p += 5;
+    }
+    b->scanned = b->len;
+    return 1;
+}
+
+static void waitPrompts(Bot *b, size_t want, const char *what) {
+    while (!b->failed && b->prompts < want) {
+        int r = pump(b, TIMEOUT_MS);
+        if (r < 0) fail(b, "dropped by the server waiting for '%s'", what);
+        else if (r == 0) fail(b, "no reply to '%s'", what);
+    }
+}
+
+/* send one command line and wait for its "chat>" */
+static void command(Bot *b, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    if (b->failed) return;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    size_t want = b->prompts + 1;
+    line[n++] = '\n';
+    if (write(b->fd, line, (size_t)n) != n) { fail(b, "write failed"); return; }
+    line[n-1] = '\0';
+    waitPrompts(b, want, line);
+}
+
+static int sharesRoom(int a, int b) {
+    if (a % ROOMS == b % ROOMS) return 1;
+    return (a % 2 == 0) && (b % 2 == 0); /* both still in Lobby */
+}
+
+/* "<tag><id>#" followed by payload bytes of one letter and '$' */
+static int formatToken(char *out, size_t cap, const char *tag, long id, size_t payload) {
+    int n = snprintf(out, cap, "%s%ld#", tag, id);
+    if (n < 0 || (size_t)n + payload + 2 > cap) return -1;
+    memset(out + n, 'a' + (int)(id % 26), payload);
+    out[n + payload] = '$';
+    out[n + payload + 1] = '\0';
+    return n + (int)payload + 1;
+}
+
+static int payloadIntact(const char *p, long id, size_t payload) {
+    for (size_t k = 0; k < payload; ++k)
+        if (p[k] != 'a' + (int)(id % 26)) return 0;
+    return p[payload] == '$';
+}
+
+/* count the tokens of t in the NUL-terminated text s */
+static void countTokens(Bot *b, const char *s, Tally *t) {
+    size_t taglen = strlen(t->tag);
+    const char *p = s;
+    while ((p = strstr(p, t->tag)) != NULL) {
+        char *end;
+        p += taglen;
+        if (*p < '0' || *p > '9') continue;
+        long id = strtol(p, &end, 10);
+        if (*end != '#') continue;
+        if (id < t->base || id >= t->base + t->n) fail(b, "%s%ld# from outside the wave", t->tag, id);
+        else if (!payloadIntact(end + 1, id, t->payload)) fail(b, "%s%ld# arrived corrupted", t->tag, id);
+        else t->counts[id - t->base]++;
+        p = end;
+    }
+}
+
+/* count tokens in the complete lines received since the last call; a
+ * message is one line, so a line cut by read() waits for its rest */
+static int scanLines(Bot *b, Tally *tallies, int ntallies) {
+    char *last = b->len > b->parsed ? memrchr(b->stream + b->parsed, '\n', b->len - b->parsed) : NULL;
+    if (last) {
+        char saved = last[1];
+        last[1] = '\0';
+        for (int i = 0; i < ntallies; ++i) countTokens(b, b->stream + b->parsed, &tallies[i]);
+        last[1] = saved;
+        b->parsed = (size_t)(last + 1 - b->stream);
+    }
+    int got = 0;
+    for (int i = 0; i < ntallies; ++i)
+        for (int k = 0; k < tallies[i].n; ++k) got += tallies[i].counts[k];
+    return got;
+}
+
+/* read until expected tokens have arrived, then linger to catch extras */
+static void collect(Bot *b, Tally *tallies, int ntallies, int expected) {
+    while (!b->failed) {
+        int got = scanLines(b, tallies, ntallies);
+        if (got >= expected) {
+            /* anything arriving now is a duplicate or stray */
+            if (pump(b, LINGER_MS) == 0) break;
+            continue;
+        }
+        int r = pump(b, TIMEOUT_MS);
+        if (r < 0) fail(b, "dropped by the server after %d of %d messages", got, expected);
+        else if (r == 0) fail(b, "got %d of %d messages", got, expected);
+    }
+}
+
+static void writeAll(Bot *b, const char *buf, size_t len) {
+    while (len > 0 && !b->failed) {
+        ssize_t n = write(b->fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { fail(b, "write failed"); return; }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void *runBot(void *arg) {
+    Bot *b = arg;
+    int next = b->idx + 1 < waveSize ? b->id + 1 : -1;
+    int burst = waveSize >= BURST_SENDERS + BURST_READERS;
+    int burstSender = burst && b->idx < BURST_SENDERS;
+    int burstReader = burst && !burstSender && b->idx < BURST_SENDERS + BURST_READERS;
+
+    /* A: MOTD, rename churn, final name */
+    waitPrompts(b, 1, "MOTD");
+    command(b, "login tmp%d", b->id);
+    command(b, "login bot%d", b->id);
+    if (burstSender) command(b, "create burst%d", b->idx);
+    pthread_barrier_wait(&barrier);
+
+    /* B: memberships and DM channels, then freeze them */
+    command(b, "create r%d", b->id % ROOMS);
+    command(b, "join r%d", b->id % ROOMS);
+    command(b, "create tmp");
+    command(b, "join tmp");
+    command(b, "users");
+    command(b, "rooms");
+    command(b, "leave tmp");
+    if (b->id % 2) command(b, "leave Lobby");
+    if (next >= 0) {
+        command(b, "connect bot%d", next);
+        if (!b->failed && !strstr(b->stream, "Connected (DM)")) fail(b, "connect bot%d failed", next);
+    }
+    pthread_barrier_wait(&barrier);
+
+    /* C: fan-out; count what should arrive */
+    int expected = 0;
+    for (int s = waveBase; s < waveBase + waveSize; ++s)
+        if (s != b->id && sharesRoom(s, b->id)) expected++;
+    if (b->idx > 0) expected++; /* DM from the previous bot */
+
+    int *msgs = calloc((size_t)waveSize, sizeof(int));
+    int *dms = calloc((size_t)waveSize, sizeof(int));
+    Tally tallies[2] = {
+        { "MSG", waveBase, waveSize, SHORT_PAYLOAD, msgs },
+        { "DM", waveBase, waveSize, SHORT_PAYLOAD, dms },
+    };
+    b->parsed = b->len;
+    if (!b->failed) {
+        char line[256];
+        int n = formatToken(line, sizeof(line), "MSG", b->id, SHORT_PAYLOAD);
+        line[n++] = '\n';
+        if (next >= 0) {
+            n += snprintf(line + n, sizeof(line) - n, "msg bot%d ", next);
+            n += formatToken(line + n, sizeof(line) - n, "DM", b->id, SHORT_PAYLOAD);
+            line[n++] = '\n';
+        }
+        writeAll(b, line, (size_t)n);
+    }
+    collect(b, tallies, 2, expected);
+    for (int i = 0; i < waveSize && !b->failed; ++i) {
+        int s = waveBase + i;
+        int wantMsg = s != b->id && sharesRoom(s, b->id);
+        int wantDm = s == b->id - 1 && b->idx > 0;
+        if (msgs[i] != wantMsg) fail(b, "MSG%d# received %d times, expected %d", s, msgs[i], wantMsg);
+        if (dms[i] != wantDm) fail(b, "DM%d# received %d times, expected %d", s, dms[i], wantDm);
+    }
+    free(msgs);
+    free(dms);
+    pthread_mutex_lock(&report_lock);
+    checked += expected;
+    pthread_mutex_unlock(&report_lock);
+    pthread_barrier_wait(&barrier);
+
+    /* E: burst; senders leave every shared room so only readers get it */
+    if (burstSender) {
+        command(b, "leave Lobby");
+        command(b, "leave r%d", b->id % ROOMS);
+        command(b, "join burst%d", b->idx);
+    } else if (burstReader) {
+        for (int i = 0; i < BURST_SENDERS; ++i) command(b, "join burst%d", i);
+    }
+    pthread_barrier_wait(&barrier);
+    if (burstSender && !b->failed) {
+        size_t linelen = BURST_PAYLOAD + 32;
+        char *lines = malloc(linelen * BURST_LINES);
+        size_t n = 0;
+        for (int k = 0; k < BURST_LINES; ++k) {
+            n += (size_t)formatToken(lines + n, linelen, "BURST", (long)b->id * BURST_LINES + k, BURST_PAYLOAD);
+            lines[n++] = '\n';
+        }
+        writeAll(b, lines, n);
+        free(lines);
+    } else if (burstReader) {
+        int *bursts = calloc(BURST_SENDERS * BURST_LINES, sizeof(int));
+        Tally tally = { "BURST", waveBase * BURST_LINES, BURST_SENDERS * BURST_LINES, BURST_PAYLOAD, bursts };
+        b->parsed = b->len;
+        b->slow = 1;
+        collect(b, &tally, 1, tally.n);
+        b->slow = 0;
+        for (int i = 0; i < tally.n && !b->failed; ++i)
+            if (bursts[i] != 1) fail(b, "BURST%d# received %d times, expected 1", tally.base + i, bursts[i]);
+        free(bursts);
+        pthread_mutex_lock(&report_lock);
+        checked += tally.n;
+        pthread_mutex_unlock(&report_lock);
+    }
+    pthread_barrier_wait(&barrier);
+
+    /* D: leave and wait for the server to hang up */
+    if (write(b->fd, "exit\n", 5) != 5 && !b->failed) fail(b, "write failed");
+    int r;
+    while ((r = pump(b, TIMEOUT_MS)) > 0) ;
+    if (r == 0 && !b->failed) fail(b, "server did not close the connection");
+    return NULL;
+}
+
+/* connected loopback TCP pair with small buffers: sv[0] driver, sv[1] server */
+static int tcpPair(int sv[2]) {
+    int small = SLOW_BUFFER, one = 1;
+    if ((sv[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    if (connect(sv[0], (struct sockaddr *)&tcpAddr, sizeof(tcpAddr)) < 0 ||
+        (sv[1] = accept(tcpListener, NULL, NULL)) < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setsockopt(sv[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static int runWave(int base, int size) {
+    pthread_t *drivers = calloc((size_t)size, sizeof(pthread_t));
+    pthread_t *servers = calloc((size_t)size, sizeof(pthread_t));
+    int *serverFds = calloc((size_t)size, sizeof(int));
+    Bot *bots = calloc((size_t)size, sizeof(Bot));
+    pthread_attr_t attr;
+    int started = 0;
+
+    waveBase = base;
+    waveSize = size;
+    pthread_barrier_init(&barrier, NULL, (unsigned)size);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+
+    for (int i = 0; i < size; ++i) {
+        int sv[2];
+        int reader = size >= BURST_SENDERS + BURST_READERS &&
+                     i >= BURST_SENDERS && i < BURST_SENDERS + BURST_READERS;
+        if (reader ? tcpPair(sv) < 0 : socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); exit(2); }
+        bots[i].id = base + i;
+        bots[i].idx = i;
+        bots[i].fd = sv[0];
+        bots[i].cap = 4096;
+        bots[i].stream = malloc(bots[i].cap);
+        bots[i].stream[0] = '\0';
+        serverFds[i] = sv[1];
+        if (pthread_create(&servers[i], &attr, client_receive, &serverFds[i]) != 0) { perror("pthread_create"); exit(2); }
+    }
+    for (int i = 0; i < size; ++i) {
+        if (pthread_create(&drivers[i], &attr, runBot, &bots[i]) != 0) { perror("pthread_create"); exit(2); }
+        started++;
+    }
+    for (int i = 0; i < started; ++i) pthread_join(drivers[i], NULL);
+    for (int i = 0; i < size; ++i) pthread_join(servers[i], NULL);
+
+    /* every client has exited, so the server must hold no state for them */
+    reader_lock();
+    if (user_head) {
+        fprintf(stderr, "wave at %d: user list not empty (%s)\n", base, user_head->username);
+        failures++;
+    }
+    for (RoomNode *r = room_head; r; r = r->next) {
+        if (r->users) {
+            fprintf(stderr, "wave at %d: room %s still has %s\n", base, r->name, r->users->username);
+            failures++;
+        }
+    }
+    reader_unlock();
+
+    for (int i = 0; i < size; ++i) {
+        close(bots[i].fd);
+        free(bots[i].stream);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_barrier_destroy(&barrier);
+    free(drivers);
+    free(servers);
+    free(serverFds);
+    free(bots);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int total = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    int wave = argc > 2 ? atoi(argv[2]) : DEFAULT_WAVE;
+    struct rlimit rl;
+
+    if (total <= 0 || wave <= 1) {
+        fprintf(stderr, "usage: %s [total_clients [clients_per_wave]]\n", argv[0]);
+        return 2;
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    socklen_t alen = sizeof(tcpAddr);
+    memset(&tcpAddr, 0, sizeof(tcpAddr));
+    tcpAddr.sin_family = AF_INET;
+    tcpAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((tcpListener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(tcpListener, (struct sockaddr *)&tcpAddr, sizeof(tcpAddr)) < 0 ||
+        listen(tcpListener, BURST_READERS) < 0 ||
+        getsockname(tcpListener, (struct sockaddr *)&tcpAddr, &alen) < 0) {
+        perror("listen");
+        return 2;
+    }
+
+    for (int base = 0; base < total; base += wave) {
+        int size = total - base < wave ? total - base : wave;
+        if (runWave(base, size)) break;
+    }
+
+    pthread_rwlock_wrlock(&rw_lock);
+    clearUserIndexU(&user_index);
+    freeAllUsersU(&user_head);
+    freeAllRoomsR(&room_head);
+    pthread_rwlock_unlock(&rw_lock);
+
+    close(tcpListener);
+    printf("stress: %d clients in waves of %d, %ld deliveries checked, %d failures\n",
+           total, wave, checked, failures);
+    return failures ? 1 : 0;
+}
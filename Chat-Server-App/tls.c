@@ -0,0 +1,343 @@
+#include "tls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef USE_TLS
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/* One slot per client fd. The owner thread holds a reference from
+ * client_open() to client_close(); threads sending to someone else's
+ * socket take one with client_hold(). The fd is only closed when the
+ * last reference goes, so it cannot be reused under an in-flight send. */
+typedef struct ClientSlot {
+    int refs;
+    int closing;              // owner has let go; stays set until the next client_open()
+    pthread_mutex_t ref_lock;
+    pthread_mutex_t send_lock; // one send_all() at a time, messages never interleave
+#ifdef USE_TLS
+    SSL *ssl;
+    int ktls_send;            // kernel encrypts writes, plain send() is enough
+    pthread_mutex_t io_lock;  // serialises SSL_read/SSL_write
+#endif
+} ClientSlot;
+
+static ClientSlot slots[MAX_CLIENT_FDS];
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+static void init_slots(void) {
+    for (int i = 0; i < MAX_CLIENT_FDS; ++i) {
+        pthread_mutex_init(&slots[i].ref_lock, NULL);
+        pthread_mutex_init(&slots[i].send_lock, NULL);
+#ifdef USE_TLS
+        pthread_mutex_init(&slots[i].io_lock, NULL);
+#endif
+    }
+}
+
+static int wait_fd(int sock, short events, int timeout_ms) {
+    struct pollfd pfd = { .fd = sock, .events = events, .revents = 0 };
+    int n;
+    while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) ;
+    return n;
+}
+
+/* A client that has not drained its socket within CLIENT_SEND_TIMEOUT_MS
+ * is cut off; its own thread then sees EOF and cleans up. The caller holds
+ * a reference, so the fd is still ours. */
+static void drop_slow_client(int sock) {
+    shutdown(sock, SHUT_RDWR);
+}
+
+/* plaintext (and kTLS) write path: never blocks past the send timeout */
+static ssize_t send_all(int sock, const void *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(sock, (const char *)buf + off, len - off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) { off += (size_t)n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_fd(sock, POLLOUT, CLIENT_SEND_TIMEOUT_MS) > 0) continue;
+            drop_slow_client(sock);
+        }
+        return off ? (ssize_t)off : -1;
+    }
+    return (ssize_t)off;
+}
+
+/* Broadcasters, DM senders and the owner thread all write to the same fd.
+ * A non-blocking send can stop partway through a message, so the whole
+ * send_all() runs under the slot's send_lock, as SSL_write() does under
+ * io_lock. */
+static ssize_t send_message(int sock, const void *buf, size_t len) {
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) return send_all(sock, buf, len);
+    pthread_once(&slots_once, init_slots);
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->send_lock);
+    ssize_t ret = send_all(sock, buf, len);
+    pthread_mutex_unlock(&s->send_lock);
+    return ret;
+}
+
+int client_open(int sock) {
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) return -1;
+    pthread_once(&slots_once, init_slots);
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->ref_lock);
+    s->refs = 1;
+    s->closing = 0;
+    pthread_mutex_unlock(&s->ref_lock);
+    return 0;
+}
+
+int client_hold(int sock) {
+    int ok = -1;
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) return -1;
+    pthread_once(&slots_once, init_slots);
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->ref_lock);
+    if (s->refs > 0 && !s->closing) {
+        s->refs++;
+        ok = 0;
+    }
+    pthread_mutex_unlock(&s->ref_lock);
+    return ok;
+}
+
+void client_release(int sock) {
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) return;
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->ref_lock);
+    if (s->refs > 0 && --s->refs == 0) {
+#ifdef USE_TLS
+        pthread_mutex_lock(&s->io_lock);
+        if (s->ssl) {
+            SSL_free(s->ssl);
+            s->ssl = NULL;
+            s->ktls_send = 0;
+        }
+        pthread_mutex_unlock(&s->io_lock);
+#endif
+        close(sock); /* under ref_lock: a new client_open on this fd waits */
+    }
+    pthread_mutex_unlock(&s->ref_lock);
+}
+
+void client_close(int sock) {
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) { close(sock); return; }
+    pthread_once(&slots_once, init_slots);
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->ref_lock);
+    if (s->closing) {
+        /* owner already closed it; the fd number may belong to a new
+         * connection by now, so leave it alone */
+        pthread_mutex_unlock(&s->ref_lock);
+        return;
+    }
+    if (s->refs == 0) {
+        /* never opened */
+        pthread_mutex_unlock(&s->ref_lock);
+        close(sock);
+        return;
+    }
+    s->closing = 1;
+    pthread_mutex_unlock(&s->ref_lock);
+
+#ifdef USE_TLS
+    pthread_mutex_lock(&s->io_lock);
+    if (s->ssl) SSL_shutdown(s->ssl);
+    pthread_mutex_unlock(&s->io_lock);
+#endif
+    /* wake any sender still blocked on this socket, then drop our ref */
+    shutdown(sock, SHUT_RDWR);
+    client_release(sock);
+}
+
+#ifdef USE_TLS
+
+static SSL_CTX *tls_ctx = NULL;
+
+int tls_init(const char *cert_file, const char *key_file) {
+    if (!cert_file || !key_file) return -1;
+    /* OpenSSL writes with write(2); a vanished peer must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+    pthread_once(&slots_once, init_slots);
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+
+    /* cheap reconnects: stateless tickets plus the server-side cache */
+    SSL_CTX_clear_options(tls_ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(tls_ctx, 2);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *)"chatserv", 8);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    /* hand record encryption to the kernel when it and the cipher allow */
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int tls_enabled(void) {
+    return tls_ctx != NULL;
+}
+
+void tls_shutdown(void) {
+    if (!tls_ctx) return;
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+int tls_session_count(int *ktls_send) {
+    int sessions = 0, ktls = 0;
+    pthread_once(&slots_once, init_slots);
+    for (int i = 0; i < MAX_CLIENT_FDS; ++i) {
+        ClientSlot *s = &slots[i];
+        pthread_mutex_lock(&s->io_lock);
+        if (s->ssl) {
+            sessions++;
+            ktls += s->ktls_send;
+        }
+        pthread_mutex_unlock(&s->io_lock);
+    }
+    if (ktls_send) *ktls_send = ktls;
+    return sessions;
+}
+
+/* blocking handshake, then switch the socket to non-blocking so a reader
+ * waiting for data never holds the session lock */
+int tls_accept_client(int sock) {
+    struct sockaddr_storage local;
+    socklen_t locallen = sizeof(local);
+    if (!tls_ctx) return 0;
+    if (sock < 0 || sock >= MAX_CLIENT_FDS) return -1;
+    /* local Unix-socket clients stay plaintext */
+    if (getsockname(sock, (struct sockaddr *)&local, &locallen) == 0 && local.ss_family == AF_UNIX) return 0;
+    /* the handshake and ticket flights are small writes; don't let Nagle
+     * hold them for the peer's delayed ACK */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    SSL *ssl = SSL_new(tls_ctx);
+    if (!ssl) return -1;
+    SSL_set_fd(ssl, sock);
+    if (SSL_accept(ssl) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->io_lock);
+    s->ssl = ssl;
+    s->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+    pthread_mutex_unlock(&s->io_lock);
+    return 0;
+}
+
+ssize_t client_send(int sock, const void *buf, size_t len) {
+    if (!tls_ctx || sock < 0 || sock >= MAX_CLIENT_FDS) return send_message(sock, buf, len);
+
+    ClientSlot *s = &slots[sock];
+    pthread_mutex_lock(&s->io_lock);
+    if (!s->ssl || s->ktls_send) {
+        /* plaintext client, or kTLS: the kernel frames and encrypts */
+        pthread_mutex_unlock(&s->io_lock);
+        return send_message(sock, buf, len);
+    }
+
+    ssize_t ret = -1;
+    while (1) {
+        int n = SSL_write(s->ssl, buf, (int)len);
+        if (n > 0) { ret = n; break; }
+        int err = SSL_get_error(s->ssl, n);
+        short ev = err == SSL_ERROR_WANT_WRITE ? POLLOUT : err == SSL_ERROR_WANT_READ ? POLLIN : 0;
+        if (!ev) break;
+        if (wait_fd(sock, ev, CLIENT_SEND_TIMEOUT_MS) <= 0) {
+            drop_slow_client(sock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->io_lock);
+    return ret;
+}
+
+ssize_t client_read(int sock, void *buf, size_t len) {
+    if (!tls_ctx || sock < 0 || sock >= MAX_CLIENT_FDS) return read(sock, buf, len);
+
+    ClientSlot *s = &slots[sock];
+    while (1) {
+        pthread_mutex_lock(&s->io_lock);
+        if (!s->ssl) {
+            pthread_mutex_unlock(&s->io_lock);
+            return read(sock, buf, len);
+        }
+        int n = SSL_read(s->ssl, buf, (int)len);
+        int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(s->ssl, n);
+        pthread_mutex_unlock(&s->io_lock);
+
+        if (n > 0) return n;
+        if (err == SSL_ERROR_WANT_READ) { wait_fd(sock, POLLIN, -1); continue; }
+        if (err == SSL_ERROR_WANT_WRITE) { wait_fd(sock, POLLOUT, -1); continue; }
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+}
+
+#else /* plaintext build */
+
+int tls_init(const char *cert_file, const char *key_file) {
+    (void)cert_file;
+    (void)key_file;
+    fprintf(stderr, "TLS support not compiled in (build with -DUSE_TLS).\n");
+    return -1;
+}
+
+int tls_enabled(void) {
+    return 0;
+}
+
+void tls_shutdown(void) {
+}
+
+int tls_session_count(int *ktls_send) {
+    if (ktls_send) *ktls_send = 0;
+    return 0;
+}
+
+int tls_accept_client(int sock) {
+    (void)sock;
+    return 0;
+}
+
+ssize_t client_send(int sock, const void *buf, size_t len) {
+    return send_message(sock, buf, len);
+}
+
+ssize_t client_read(int sock, void *buf, size_t len) {
+    return read(sock, buf, len);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef TLS_H
+#define TLS_H
+
+/* System headers */
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Client transport. Built with -DUSE_TLS these wrap OpenSSL sessions,
+ * otherwise they are thin wrappers over the plain socket calls. */
+
+#define MAX_CLIENT_FDS 8192          // per-client slots are indexed by fd
+#ifndef CLIENT_SEND_TIMEOUT_MS
+#define CLIENT_SEND_TIMEOUT_MS 2000  // a client this far behind is dropped
+#endif
+
+/* setup/teardown (call tls_init once before accepting clients) */
+int tls_init(const char *cert_file, const char *key_file);
+int tls_enabled(void);
+void tls_shutdown(void);
+/* TLS sessions currently open, and how many of them the kernel encrypts
+ * (kTLS send), so broadcasts to them take the plain send() path */
+int tls_session_count(int *ktls_send);
+
+/* per-client: client_open() when the owner thread starts, client_close()
+ * when it is done. Any other thread sending to the socket brackets the send
+ * with client_hold()/client_release() so the fd stays valid meanwhile. */
+int client_open(int sock);
+int client_hold(int sock);
+void client_release(int sock);
+int tls_accept_client(int sock);
+ssize_t client_send(int sock, const void *buf, size_t len);
+ssize_t client_read(int sock, void *buf, size_t len);
+void client_close(int sock);
+
+#endif // TLS_H